@@ -0,0 +1 @@
+DROP TABLE ocr_cache;
@@ -0,0 +1,9 @@
+-- OCR results keyed on a hash of the models and the decoded image
+CREATE TABLE ocr_cache (
+    content_hash BYTEA PRIMARY KEY,
+    ocr_text TEXT,
+    created_at TIMESTAMPTZ NOT NULL DEFAULT now()
+);
+
+-- Rows older than OCR_RESULT_CACHE_DAYS are deleted on insert
+CREATE INDEX idx_ocr_cache_created_at ON ocr_cache(created_at);
@@ -8,6 +8,15 @@ pub struct Config {
     pub jwt_secret: String,
     pub static_dir: Option<String>,
     pub model_dir: String,
+    pub ocr_cache_dir: Option<String>,
+    pub ocr_idle_trim_secs: u64,
+    pub ocr_dynamic_quant: bool,
+    pub ocr_warm_up: bool,
+    pub ocr_cpus: Option<String>,
+    pub ocr_numa_node: Option<u32>,
+    pub ocr_result_cache_size: usize,
+    pub ocr_result_cache_persist: bool,
+    pub ocr_result_cache_days: u32,
     pub storage_backend: String,
     pub s3_bucket: Option<String>,
     pub s3_region: Option<String>,
@@ -32,6 +41,30 @@ impl Config {
                 .unwrap_or_else(|_| "dev-secret-change-in-production".to_string()),
             static_dir: env::var("STATIC_DIR").ok(),
             model_dir: env::var("MODEL_DIR").unwrap_or_else(|_| "./models".to_string()),
+            ocr_cache_dir: env::var("OCR_CACHE_DIR").ok(),
+            ocr_idle_trim_secs: env::var("OCR_IDLE_TRIM_SECS")
+                .ok()
+                .and_then(|s| s.parse().ok())
+                .unwrap_or(300),
+            ocr_dynamic_quant: env::var("OCR_DYNAMIC_QUANT")
+                .map(|v| v == "1" || v.eq_ignore_ascii_case("true"))
+                .unwrap_or(false),
+            ocr_warm_up: env::var("OCR_WARM_UP")
+                .map(|v| v == "1" || v.eq_ignore_ascii_case("true"))
+                .unwrap_or(true),
+            ocr_cpus: env::var("OCR_CPUS").ok(),
+            ocr_numa_node: env::var("OCR_NUMA_NODE").ok().and_then(|s| s.parse().ok()),
+            ocr_result_cache_size: env::var("OCR_RESULT_CACHE_SIZE")
+                .ok()
+                .and_then(|s| s.parse().ok())
+                .unwrap_or(4096),
+            ocr_result_cache_persist: env::var("OCR_RESULT_CACHE_PERSIST")
+                .map(|v| v == "1" || v.eq_ignore_ascii_case("true"))
+                .unwrap_or(true),
+            ocr_result_cache_days: env::var("OCR_RESULT_CACHE_DAYS")
+                .ok()
+                .and_then(|s| s.parse().ok())
+                .unwrap_or(90),
             storage_backend: env::var("STORAGE_BACKEND").unwrap_or_else(|_| "local".to_string()),
             s3_bucket: env::var("S3_BUCKET").ok(),
             s3_region: env::var("S3_REGION").ok(),
@@ -11,7 +11,7 @@ mod video;
 use std::process;
 use std::sync::Arc;
 
-use axum::{extract::State, routing::get, Json, Router};
+use axum::{extract::State, http::header, response::IntoResponse, routing::get, Json, Router};
 use clap::Parser;
 use config::Config;
 use ocr_rs::OcrEngine;
@@ -62,6 +62,17 @@ async fn health(State(state): State<AppState>) -> Json<serde_json::Value> {
     Json(serde_json::json!({ "status": "ok", "db": row.0 == 1 }))
 }
 
+/// Prometheus metrics of the OCR engine; empty when OCR is disabled.
+async fn metrics(State(state): State<AppState>) -> impl IntoResponse {
+    let body = match state.ocr {
+        Some(engine) => tokio::task::spawn_blocking(move || ocr::render_metrics(&engine))
+            .await
+            .unwrap_or_default(),
+        None => String::new(),
+    };
+    ([(header::CONTENT_TYPE, "text/plain; version=0.0.4")], body)
+}
+
 #[tokio::main]
 async fn main() {
     let cli = Cli::parse();
@@ -151,7 +162,22 @@ async fn run_server() {
         .await
         .expect("failed to run migrations");
 
-    let ocr = ocr::init_engine(&config.model_dir);
+    let ocr = ocr::init_engine(
+        &config.model_dir,
+        config.ocr_cache_dir.as_deref(),
+        config.ocr_idle_trim_secs,
+        config.ocr_dynamic_quant,
+        config.ocr_warm_up,
+        &ocr::cpu_ids(config.ocr_cpus.as_deref(), config.ocr_numa_node),
+    );
+    if ocr.is_some() {
+        ocr::init_result_cache(
+            &config.model_dir,
+            config.ocr_result_cache_size,
+            config.ocr_result_cache_persist,
+            config.ocr_result_cache_days,
+        );
+    }
     let storage = match config.storage_backend.as_str() {
         "s3" => {
             let bucket = config
@@ -190,6 +216,7 @@ async fn run_server() {
 
     let mut app = Router::new()
         .route("/api/health", get(health))
+        .route("/api/metrics", get(metrics))
         .merge(routes::api_router(state.config.enable_test_routes))
         .layer(CorsLayer::permissive())
         .layer(TraceLayer::new_for_http())
@@ -1,17 +1,71 @@
+use std::collections::HashMap;
+use std::fmt::Write;
+use std::future::Future;
 use std::path::Path;
-use std::sync::Arc;
+use std::sync::{Arc, Mutex, OnceLock};
+use std::time::{Duration, Instant};
 
-use ocr_rs::OcrEngine;
+use image::DynamicImage;
+use ocr_rs::{
+    DynamicQuant, InferenceStats, OcrEngine, OcrEngineConfig, OcrResult_, Phase, RunOptions,
+};
+use sha2::{Digest, Sha256};
 use sqlx::PgPool;
+use tokio::sync::Semaphore;
+use tokio::task::JoinError;
 use uuid::Uuid;
 
+const DET_MODEL: &str = "PP-OCRv5_mobile_det.mnn";
+const REC_MODEL: &str = "latin_PP-OCRv5_mobile_rec_infer.mnn";
+const KEYS_FILE: &str = "ppocr_keys_latin.txt";
+
+/// Typical upload sizes warmed up at startup: square, landscape and portrait
+/// at the det side limit.
+const WARM_UP_SIZES: [(u32, u32); 3] = [(960, 960), (960, 540), (540, 960)];
+
+/// Sessions per model. Background OCR may hold all but one of them, so an
+/// interactive request never waits behind a bulk upload.
+const SESSION_POOL_SIZE: usize = 2;
+
+/// Resolve the cores OCR inference is pinned to from an explicit CPU list
+/// (e.g. `8-15`) or a NUMA node; the list wins when both are given.
+/// Returns an empty list, leaving threads unpinned, when neither is set or
+/// the value is invalid.
+pub fn cpu_ids(cpus: Option<&str>, numa_node: Option<u32>) -> Vec<i32> {
+    if let Some(list) = cpus {
+        match ocr_rs::mnn::parse_cpu_list(list) {
+            Some(ids) => return ids,
+            None => tracing::warn!("Ignoring invalid OCR CPU list: {list}"),
+        }
+    } else if let Some(node) = numa_node {
+        match ocr_rs::mnn::numa_node_cpus(node) {
+            Some(ids) => return ids,
+            None => tracing::warn!("Ignoring unknown NUMA node for OCR: {node}"),
+        }
+    }
+    Vec::new()
+}
+
 /// Try to initialize the OCR engine from model files in the given directory.
+/// With `cache_dir`, backend tuning results persist there across restarts.
+/// `dynamic_quant` runs weight-quantized models on int8 kernels.
+/// With `warm_up`, the models run once for typical upload sizes before this
+/// returns, so the first uploads after startup are not slow. An idle trim
+/// releases those plans again; it is not followed by another warm-up.
+/// With `cpu_ids`, inference threads are pinned to those cores, one per core.
 /// Returns `None` if models are not found or initialization fails.
-pub fn init_engine(model_dir: &str) -> Option<Arc<OcrEngine>> {
+pub fn init_engine(
+    model_dir: &str,
+    cache_dir: Option<&str>,
+    idle_trim_secs: u64,
+    dynamic_quant: bool,
+    warm_up: bool,
+    cpu_ids: &[i32],
+) -> Option<Arc<OcrEngine>> {
     let dir = Path::new(model_dir);
-    let det_path = dir.join("PP-OCRv5_mobile_det.mnn");
-    let rec_path = dir.join("latin_PP-OCRv5_mobile_rec_infer.mnn");
-    let keys_path = dir.join("ppocr_keys_latin.txt");
+    let det_path = dir.join(DET_MODEL);
+    let rec_path = dir.join(REC_MODEL);
+    let keys_path = dir.join(KEYS_FILE);
 
     for path in [&det_path, &rec_path, &keys_path] {
         if !path.exists() {
@@ -20,14 +74,38 @@ pub fn init_engine(model_dir: &str) -> Option<Arc<OcrEngine>> {
         }
     }
 
+    let mut config = OcrEngineConfig::new().with_session_pool_size(SESSION_POOL_SIZE);
+    if let Some(dir) = cache_dir {
+        config = config.with_cache_dir(dir);
+    }
+    // Uploads are bursty; hand buffers sized for the last big image back when idle
+    if idle_trim_secs > 0 {
+        config = config.with_idle_trim(Duration::from_secs(idle_trim_secs));
+    }
+    if dynamic_quant {
+        config = config.with_dynamic_quant(DynamicQuant::PerBatch);
+    }
+    if warm_up {
+        config = config.with_warm_up(WARM_UP_SIZES.to_vec());
+    }
+    if !cpu_ids.is_empty() {
+        config = config.with_threads(0).with_cpu_ids(cpu_ids);
+    }
+
+    let start = Instant::now();
     match OcrEngine::new(
         det_path.to_str().unwrap(),
         rec_path.to_str().unwrap(),
         keys_path.to_str().unwrap(),
-        None,
+        Some(config),
     ) {
         Ok(engine) => {
-            tracing::info!("OCR engine initialized from {model_dir}");
+            tracing::info!(
+                "OCR engine initialized from {model_dir} ({:?} backend, {} threads) in {:?}",
+                engine.backend(),
+                engine.thread_count(),
+                start.elapsed()
+            );
             Some(Arc::new(engine))
         }
         Err(e) => {
@@ -37,36 +115,355 @@ pub fn init_engine(model_dir: &str) -> Option<Arc<OcrEngine>> {
     }
 }
 
-/// Run OCR on image bytes. Returns the recognized text or None on failure.
-pub fn recognize(engine: &OcrEngine, image_bytes: &[u8]) -> Option<String> {
-    let image = match image::load_from_memory(image_bytes) {
-        Ok(img) => img,
-        Err(e) => {
-            tracing::warn!("OCR: failed to decode image: {e}");
-            return None;
+/// SHA-256 of the OCR models and a decoded image.
+type CacheKey = [u8; 32];
+
+/// OCR results by decoded image content, so reuploads of an image (or a
+/// re-encode with the same pixels) skip inference. `None` results record
+/// images without text. Perceptual hashes are deliberately not used: memes
+/// sharing a template differ mostly in their caption.
+struct ResultCache {
+    /// Hash of the model files, so results of replaced models are never served
+    models: CacheKey,
+    /// Entries per generation, 0 for no in-memory cache
+    generation_size: usize,
+    /// Whether results are also kept in the `ocr_cache` table
+    persist: bool,
+    /// Days a row stays in `ocr_cache`, 0 to keep rows forever
+    persist_days: u32,
+    /// Current and previous generation. Inserts go into the current one, which
+    /// replaces the previous one when full; hits in the previous one move to
+    /// the current one. This keeps recently used entries like an LRU, without
+    /// tracking order per entry.
+    generations: Mutex<[HashMap<CacheKey, Option<String>>; 2]>,
+}
+
+impl ResultCache {
+    fn key(&self, image: &DynamicImage) -> CacheKey {
+        let color = image.color();
+        let mut hasher = Sha256::new();
+        hasher.update(self.models);
+        hasher.update(image.width().to_le_bytes());
+        hasher.update(image.height().to_le_bytes());
+        hasher.update([color.bytes_per_pixel(), color.channel_count()]);
+        hasher.update(image.as_bytes());
+        hasher.finalize().into()
+    }
+
+    fn insert_memory(&self, key: CacheKey, text: Option<String>) {
+        if self.generation_size == 0 {
+            return;
         }
-    };
+        let mut generations = self.generations.lock().unwrap();
+        if generations[0].len() >= self.generation_size {
+            generations[1] = std::mem::take(&mut generations[0]);
+        }
+        generations[0].insert(key, text);
+    }
 
-    match engine.recognize(&image) {
-        Ok(results) => {
-            let text: String = results
-                .iter()
-                .map(|r| r.text.as_str())
-                .collect::<Vec<_>>()
-                .join("\n");
-            if text.trim().is_empty() {
-                None
-            } else {
+    fn get_memory(&self, key: &CacheKey) -> Option<Option<String>> {
+        let mut generations = self.generations.lock().unwrap();
+        if let Some(text) = generations[0].get(key) {
+            return Some(text.clone());
+        }
+        let text = generations[1].remove(key)?;
+        drop(generations);
+        self.insert_memory(*key, text.clone());
+        Some(text)
+    }
+
+    async fn get(&self, db: &PgPool, key: &CacheKey) -> Option<Option<String>> {
+        if let Some(text) = self.get_memory(key) {
+            return Some(text);
+        }
+        if !self.persist {
+            return None;
+        }
+        match sqlx::query_as::<_, (Option<String>,)>(
+            "SELECT ocr_text FROM ocr_cache WHERE content_hash = $1",
+        )
+        .bind(&key[..])
+        .fetch_optional(db)
+        .await
+        {
+            Ok(row) => {
+                let (text,) = row?;
+                self.insert_memory(*key, text.clone());
                 Some(text)
             }
+            Err(e) => {
+                tracing::warn!("Failed to read OCR result cache: {e}");
+                None
+            }
+        }
+    }
+
+    async fn insert(&self, db: &PgPool, key: CacheKey, text: &Option<String>) {
+        self.insert_memory(key, text.clone());
+        if !self.persist {
+            return;
+        }
+        if let Err(e) = sqlx::query(
+            "INSERT INTO ocr_cache (content_hash, ocr_text) VALUES ($1, $2) \
+             ON CONFLICT (content_hash) DO NOTHING",
+        )
+        .bind(&key[..])
+        .bind(text)
+        .execute(db)
+        .await
+        {
+            tracing::warn!("Failed to write OCR result cache: {e}");
+            return;
+        }
+
+        // Expire old rows here rather than on a timer; the created_at index
+        // keeps this cheap when there is nothing to delete
+        if self.persist_days == 0 {
+            return;
+        }
+        if let Err(e) = sqlx::query(
+            "DELETE FROM ocr_cache WHERE created_at < now() - make_interval(days => $1)",
+        )
+        .bind(self.persist_days as i32)
+        .execute(db)
+        .await
+        {
+            tracing::warn!("Failed to prune OCR result cache: {e}");
+        }
+    }
+}
+
+fn result_cache() -> &'static OnceLock<ResultCache> {
+    static CACHE: OnceLock<ResultCache> = OnceLock::new();
+    &CACHE
+}
+
+/// Set up the OCR result cache with room for `capacity` results in memory.
+/// With `persist`, results are also stored in the database and survive
+/// restarts, for `persist_days` days (0 keeps them). Without either, every
+/// image runs through the models.
+pub fn init_result_cache(model_dir: &str, capacity: usize, persist: bool, persist_days: u32) {
+    if capacity == 0 && !persist {
+        return;
+    }
+
+    let mut models = Sha256::new();
+    for name in [DET_MODEL, REC_MODEL, KEYS_FILE] {
+        match std::fs::read(Path::new(model_dir).join(name)) {
+            Ok(bytes) => {
+                models.update((bytes.len() as u64).to_le_bytes());
+                models.update(&bytes);
+            }
+            Err(e) => {
+                tracing::warn!("OCR result cache disabled, failed to read {name}: {e}");
+                return;
+            }
         }
+    }
+
+    let cache = ResultCache {
+        models: models.finalize().into(),
+        generation_size: capacity.div_ceil(2),
+        persist,
+        persist_days,
+        generations: Mutex::new([HashMap::new(), HashMap::new()]),
+    };
+    if result_cache().set(cache).is_ok() {
+        tracing::info!("OCR result cache enabled ({capacity} in memory, persist: {persist})");
+    }
+}
+
+/// Decode image bytes and run `run` on them, unless the result cache already
+/// holds the text for the decoded image. A `gate` permit is taken only for
+/// `run`, so cache hits never wait behind inference. Returns the recognized
+/// text, or `None` when there is none or OCR failed; `Err` if decoding panicked.
+async fn recognize_cached<F, Fut>(
+    db: &PgPool,
+    image_bytes: Vec<u8>,
+    gate: Option<&Semaphore>,
+    run: F,
+) -> Result<Option<String>, JoinError>
+where
+    F: FnOnce(DynamicImage) -> Fut,
+    Fut: Future<Output = ocr_rs::OcrResult<Vec<OcrResult_>>>,
+{
+    let cache = result_cache().get();
+    let decoded = tokio::task::spawn_blocking(move || {
+        let image = decode_image(&image_bytes)?;
+        let key = cache.map(|cache| cache.key(&image));
+        Some((image, key))
+    })
+    .await?;
+    let Some((image, key)) = decoded else {
+        return Ok(None);
+    };
+
+    if let (Some(cache), Some(key)) = (cache, &key) {
+        if let Some(text) = cache.get(db, key).await {
+            return Ok(text);
+        }
+    }
+
+    let _permit = match gate {
+        Some(gate) => match gate.acquire().await {
+            Ok(permit) => Some(permit),
+            Err(_) => return Ok(None),
+        },
+        None => None,
+    };
+
+    // Inference runs on the session pools' workers, so no blocking thread is
+    // parked while it waits for a session
+    let text = match run(image).await {
+        Ok(results) => collect_text(&results),
         Err(e) => {
             tracing::warn!("OCR recognition failed: {e}");
+            return Ok(None);
+        }
+    };
+    if let (Some(cache), Some(key)) = (cache, key) {
+        cache.insert(db, key, &text).await;
+    }
+    Ok(text)
+}
+
+/// Run OCR on image bytes. Returns the recognized text or None on failure.
+pub async fn recognize(
+    engine: Arc<OcrEngine>,
+    db: &PgPool,
+    image_bytes: Vec<u8>,
+) -> Result<Option<String>, JoinError> {
+    recognize_cached(db, image_bytes, None, move |image| async move {
+        engine.recognize_async(image, RunOptions::new()).await
+    })
+    .await
+}
+
+fn decode_image(image_bytes: &[u8]) -> Option<DynamicImage> {
+    match image::load_from_memory(image_bytes) {
+        Ok(img) => Some(img),
+        Err(e) => {
+            tracing::warn!("OCR: failed to decode image: {e}");
             None
         }
     }
 }
 
+fn collect_text(results: &[OcrResult_]) -> Option<String> {
+    let text: String = results
+        .iter()
+        .map(|r| r.text.as_str())
+        .collect::<Vec<_>>()
+        .join("\n");
+    if text.trim().is_empty() {
+        None
+    } else {
+        Some(text)
+    }
+}
+
+/// Render the engine's inference stats in the Prometheus text format.
+pub fn render_metrics(engine: &OcrEngine) -> String {
+    let stats = match engine.stats() {
+        Ok(stats) => stats,
+        Err(e) => {
+            tracing::warn!("Failed to read OCR stats: {e}");
+            return String::new();
+        }
+    };
+    let mut models = vec![("det", stats.det), ("rec", stats.rec)];
+    if let Some(ori) = stats.ori {
+        models.push(("ori", ori));
+    }
+
+    let mut out = String::new();
+    let scalars: [(&str, &str, &str, fn(&InferenceStats) -> f64); 7] = [
+        ("ocr_inference_runs_total", "counter", "Session runs", |s| {
+            s.runs as f64
+        }),
+        (
+            "ocr_inference_errors_total",
+            "counter",
+            "Failed session runs",
+            |s| s.errors as f64,
+        ),
+        (
+            "ocr_inference_resizes_total",
+            "counter",
+            "Session re-plans for a new input shape",
+            |s| s.resizes as f64,
+        ),
+        (
+            "ocr_inference_queue_depth",
+            "gauge",
+            "Callers waiting for a session",
+            |s| s.queue_depth as f64,
+        ),
+        (
+            "ocr_inference_peak_queue_depth",
+            "gauge",
+            "Most callers ever waiting at once",
+            |s| s.peak_queue_depth as f64,
+        ),
+        (
+            "ocr_inference_memory_megabytes",
+            "gauge",
+            "MNN-reported session memory",
+            |s| s.memory_mb as f64,
+        ),
+        (
+            "ocr_inference_mflops",
+            "gauge",
+            "MFLOPs of one run at the latest shape",
+            |s| s.flops_m as f64,
+        ),
+    ];
+    for (name, kind, help, value) in scalars {
+        let _ = writeln!(out, "# HELP {name} {help}\n# TYPE {name} {kind}");
+        for (model, stats) in &models {
+            let _ = writeln!(out, "{name}{{model=\"{model}\"}} {}", value(stats));
+        }
+    }
+
+    let name = "ocr_inference_phase_seconds";
+    let _ = writeln!(out, "# HELP {name} Time spent per inference phase");
+    let _ = writeln!(out, "# TYPE {name} histogram");
+    for (model, stats) in &models {
+        for phase in Phase::ALL {
+            let histogram = stats.phase(phase);
+            let labels = format!("model=\"{model}\",phase=\"{}\"", phase.name());
+            let mut cumulative = 0;
+            for (i, count) in histogram.buckets.iter().enumerate() {
+                cumulative += count;
+                let le = match histogram.bucket_bound(i) {
+                    Some(bound) => bound.as_secs_f64().to_string(),
+                    None => "+Inf".to_string(),
+                };
+                let _ = writeln!(out, "{name}_bucket{{{labels},le=\"{le}\"}} {cumulative}");
+            }
+            let _ = writeln!(
+                out,
+                "{name}_sum{{{labels}}} {}",
+                histogram.total.as_secs_f64()
+            );
+            let _ = writeln!(out, "{name}_count{{{labels}}} {}", histogram.count);
+        }
+    }
+    out
+}
+
+/// Background OCR jobs in flight, so detection of one upload overlaps
+/// recognition of the previous one during bulk uploads.
+const BACKGROUND_DEPTH: usize = 2;
+
+/// Caps concurrent background OCR at BACKGROUND_DEPTH. The jobs also run at
+/// background priority, so interactive requests take the session pools'
+/// free sessions first.
+fn background_gate() -> &'static Semaphore {
+    static GATE: OnceLock<Semaphore> = OnceLock::new();
+    GATE.get_or_init(|| Semaphore::new(BACKGROUND_DEPTH))
+}
+
 /// Spawn a background task to run OCR on the given bytes and update the database.
 pub fn spawn_ocr_task(
     engine: Arc<OcrEngine>,
@@ -75,8 +472,17 @@ pub fn spawn_ocr_task(
     image_bytes: Vec<u8>,
 ) {
     tokio::spawn(async move {
-        let result =
-            tokio::task::spawn_blocking(move || recognize(&engine, &image_bytes)).await;
+        let result = recognize_cached(
+            &db,
+            image_bytes,
+            Some(background_gate()),
+            move |image| async move {
+                engine
+                    .recognize_async(image, RunOptions::background())
+                    .await
+            },
+        )
+        .await;
 
         match result {
             Ok(Some(text)) => {
@@ -722,8 +722,7 @@ async fn run_ocr(
     let bytes = state.storage.get(&ocr_key).await
         .map_err(|e| AppError::Internal(format!("Failed to read file for OCR: {e}")))?;
 
-    let engine = ocr_engine.clone();
-    let ocr_text = tokio::task::spawn_blocking(move || crate::ocr::recognize(&engine, &bytes))
+    let ocr_text = crate::ocr::recognize(ocr_engine.clone(), &state.db, bytes)
         .await
         .map_err(|e| AppError::Internal(format!("OCR task panicked: {e}")))?;
 